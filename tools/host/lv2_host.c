@@ -0,0 +1,497 @@
+/*
+ * lv2_host.c
+ *
+ * POSIX / pthreads implementations of the lv2 calls in lv2_host.h. Ids
+ * are small indices into fixed tables, like the kernel objects they
+ * replace; nothing here is meant to be fast except the file calls, which
+ * go straight to the corresponding POSIX call.
+ */
+
+#define _GNU_SOURCE
+#include "lv2_host.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+/* <sys/stat.h> maps these onto struct stat's timespecs; sysFSStat has
+ * plain fields of the same names */
+#undef st_atime
+#undef st_mtime
+#undef st_ctime
+
+#define HOST_MAX_THREADS 16
+#define HOST_MAX_SYNC    16
+#define HOST_MAX_QUEUES  4
+#define HOST_QUEUE_DEPTH 64
+#define HOST_MAX_DIRS    8
+
+char host_root[256] = "";
+int host_no_sleep = 0;
+host_stats_t host_stats;
+
+#define HOST_COUNT(field, v) __atomic_fetch_add(&host_stats.field, (uint64_t)(v), __ATOMIC_RELAXED)
+
+/* --- Threads --- */
+
+typedef struct {
+    pthread_t tid;
+    void (*entry)(uint64_t);
+    uint64_t arg;
+    int used;
+} host_thread_t;
+
+static host_thread_t host_threads[HOST_MAX_THREADS];
+static pthread_mutex_t host_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *host_thread_main(void *p) {
+    host_thread_t *t = (host_thread_t*)p;
+    t->entry(t->arg);
+    return NULL;
+}
+
+int sys_ppu_thread_create(sys_ppu_thread_t *id, void (*entry)(uint64_t), uint64_t arg,
+                          int prio, size_t stacksize, uint64_t flags, const char *name) {
+    (void)prio;
+    (void)flags;
+    (void)name;
+    pthread_mutex_lock(&host_table_lock);
+    int i = 0;
+    while (i < HOST_MAX_THREADS && host_threads[i].used) i++;
+    if (i == HOST_MAX_THREADS) {
+        pthread_mutex_unlock(&host_table_lock);
+        return -1;
+    }
+    host_threads[i].used = 1;
+    pthread_mutex_unlock(&host_table_lock);
+
+    host_threads[i].entry = entry;
+    host_threads[i].arg = arg;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (stacksize < (size_t)PTHREAD_STACK_MIN) stacksize = (size_t)PTHREAD_STACK_MIN;
+    pthread_attr_setstacksize(&attr, stacksize);
+    int rc = pthread_create(&host_threads[i].tid, &attr, host_thread_main, &host_threads[i]);
+    pthread_attr_destroy(&attr);
+    if (rc != 0) {
+        host_threads[i].used = 0;
+        return -1;
+    }
+    *id = (sys_ppu_thread_t)i;
+    return 0;
+}
+
+int sys_ppu_thread_join(sys_ppu_thread_t id, uint64_t *exit_status) {
+    if (id >= HOST_MAX_THREADS || !host_threads[id].used) return -1;
+    pthread_join(host_threads[id].tid, NULL);
+    host_threads[id].used = 0;
+    if (exit_status) *exit_status = 0;
+    return 0;
+}
+
+void sys_ppu_thread_exit(uint64_t val) {
+    (void)val;
+    pthread_exit(NULL);
+}
+
+/* --- Mutexes and condition variables --- */
+
+static pthread_mutex_t host_mutex[HOST_MAX_SYNC];
+static int host_mutex_used[HOST_MAX_SYNC];
+
+typedef struct {
+    pthread_cond_t cond;
+    sys_mutex_t mutex;
+    int used;
+} host_cond_t;
+
+static host_cond_t host_cond[HOST_MAX_SYNC];
+
+/* host_deadline: absolute time on clock timeout_us from now */
+static void host_deadline(struct timespec *ts, clockid_t clock, uint64_t timeout_us) {
+    clock_gettime(clock, ts);
+    ts->tv_sec += (time_t)(timeout_us / 1000000);
+    ts->tv_nsec += (long)(timeout_us % 1000000) * 1000;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+int sys_mutex_create(sys_mutex_t *m, sys_mutex_attribute_t *attr) {
+    (void)attr;
+    pthread_mutex_lock(&host_table_lock);
+    for (int i = 0; i < HOST_MAX_SYNC; i++) {
+        if (!host_mutex_used[i]) {
+            host_mutex_used[i] = 1;
+            pthread_mutex_init(&host_mutex[i], NULL);
+            pthread_mutex_unlock(&host_table_lock);
+            *m = (sys_mutex_t)i;
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&host_table_lock);
+    return -1;
+}
+
+int sys_mutex_destroy(sys_mutex_t m) {
+    if (m >= HOST_MAX_SYNC || !host_mutex_used[m]) return -1;
+    pthread_mutex_destroy(&host_mutex[m]);
+    host_mutex_used[m] = 0;
+    return 0;
+}
+
+int sys_mutex_lock(sys_mutex_t m, uint64_t timeout) {
+    if (m >= HOST_MAX_SYNC) return -1;
+    if (timeout == 0) return pthread_mutex_lock(&host_mutex[m]) == 0 ? 0 : -1;
+    struct timespec ts;
+    host_deadline(&ts, CLOCK_REALTIME, timeout);
+    return pthread_mutex_timedlock(&host_mutex[m], &ts) == 0 ? 0 : -1;
+}
+
+int sys_mutex_unlock(sys_mutex_t m) {
+    if (m >= HOST_MAX_SYNC) return -1;
+    return pthread_mutex_unlock(&host_mutex[m]) == 0 ? 0 : -1;
+}
+
+int sys_cond_create(sys_cond_t *c, sys_mutex_t m, sys_cond_attribute_t *attr) {
+    (void)attr;
+    pthread_mutex_lock(&host_table_lock);
+    for (int i = 0; i < HOST_MAX_SYNC; i++) {
+        if (!host_cond[i].used) {
+            pthread_condattr_t ca;
+            pthread_condattr_init(&ca);
+            pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+            pthread_cond_init(&host_cond[i].cond, &ca);
+            pthread_condattr_destroy(&ca);
+            host_cond[i].mutex = m;
+            host_cond[i].used = 1;
+            pthread_mutex_unlock(&host_table_lock);
+            *c = (sys_cond_t)i;
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&host_table_lock);
+    return -1;
+}
+
+int sys_cond_destroy(sys_cond_t c) {
+    if (c >= HOST_MAX_SYNC || !host_cond[c].used) return -1;
+    pthread_cond_destroy(&host_cond[c].cond);
+    host_cond[c].used = 0;
+    return 0;
+}
+
+int sys_cond_wait(sys_cond_t c, uint64_t timeout) {
+    if (c >= HOST_MAX_SYNC || !host_cond[c].used) return -1;
+    pthread_mutex_t *m = &host_mutex[host_cond[c].mutex];
+    if (timeout == 0) return pthread_cond_wait(&host_cond[c].cond, m) == 0 ? 0 : -1;
+    struct timespec ts;
+    host_deadline(&ts, CLOCK_MONOTONIC, timeout);
+    return pthread_cond_timedwait(&host_cond[c].cond, m, &ts) == 0 ? 0 : -1;
+}
+
+int sys_cond_signal(sys_cond_t c) {
+    if (c >= HOST_MAX_SYNC || !host_cond[c].used) return -1;
+    return pthread_cond_signal(&host_cond[c].cond) == 0 ? 0 : -1;
+}
+
+/* --- Event queues and ports --- */
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    sys_event_t ev[HOST_QUEUE_DEPTH];
+    unsigned head, tail, depth;
+    int used, closed;
+} host_queue_t;
+
+static host_queue_t host_queue[HOST_MAX_QUEUES];
+static int host_port_queue[HOST_MAX_QUEUES];   /* port -> queue, -1 = none */
+static int host_port_used[HOST_MAX_QUEUES];
+
+int sys_event_queue_create(sys_event_queue_t *q, sys_event_queue_attribute_t *attr,
+                           uint64_t key, int size) {
+    (void)attr;
+    (void)key;
+    if (size <= 0 || size > HOST_QUEUE_DEPTH) return -1;
+    pthread_mutex_lock(&host_table_lock);
+    for (int i = 0; i < HOST_MAX_QUEUES; i++) {
+        host_queue_t *hq = &host_queue[i];
+        if (hq->used) continue;
+        pthread_mutex_init(&hq->lock, NULL);
+        pthread_cond_init(&hq->cond, NULL);
+        hq->head = hq->tail = 0;
+        hq->depth = (unsigned)size;
+        hq->closed = 0;
+        hq->used = 1;
+        pthread_mutex_unlock(&host_table_lock);
+        *q = (sys_event_queue_t)i;
+        return 0;
+    }
+    pthread_mutex_unlock(&host_table_lock);
+    return -1;
+}
+
+/* A forced destroy wakes every receiver with an error, as on lv2 */
+int sys_event_queue_destroy(sys_event_queue_t q, int mode) {
+    (void)mode;
+    if (q >= HOST_MAX_QUEUES || !host_queue[q].used) return -1;
+    host_queue_t *hq = &host_queue[q];
+    pthread_mutex_lock(&hq->lock);
+    hq->closed = 1;
+    pthread_cond_broadcast(&hq->cond);
+    pthread_mutex_unlock(&hq->lock);
+    hq->used = 0;
+    return 0;
+}
+
+int sys_event_queue_receive(sys_event_queue_t q, sys_event_t *ev, uint64_t timeout) {
+    if (q >= HOST_MAX_QUEUES) return -1;
+    host_queue_t *hq = &host_queue[q];
+    struct timespec ts;
+    int rc = 0;
+    if (timeout) host_deadline(&ts, CLOCK_REALTIME, timeout);
+    pthread_mutex_lock(&hq->lock);
+    while (hq->head == hq->tail && !hq->closed && rc == 0)
+        rc = timeout ? pthread_cond_timedwait(&hq->cond, &hq->lock, &ts) :
+                       pthread_cond_wait(&hq->cond, &hq->lock);
+    if (hq->head == hq->tail) {
+        pthread_mutex_unlock(&hq->lock);
+        return -1; /* destroyed or timed out */
+    }
+    *ev = hq->ev[hq->tail % HOST_QUEUE_DEPTH];
+    hq->tail++;
+    pthread_mutex_unlock(&hq->lock);
+    return 0;
+}
+
+int sys_event_port_create(sys_event_port_t *p, int type, uint64_t name) {
+    (void)type;
+    (void)name;
+    pthread_mutex_lock(&host_table_lock);
+    for (int i = 0; i < HOST_MAX_QUEUES; i++) {
+        if (!host_port_used[i]) {
+            host_port_used[i] = 1;
+            host_port_queue[i] = -1;
+            pthread_mutex_unlock(&host_table_lock);
+            *p = (sys_event_port_t)i;
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&host_table_lock);
+    return -1;
+}
+
+int sys_event_port_destroy(sys_event_port_t p) {
+    if (p >= HOST_MAX_QUEUES || !host_port_used[p]) return -1;
+    host_port_used[p] = 0;
+    return 0;
+}
+
+int sys_event_port_connect_local(sys_event_port_t p, sys_event_queue_t q) {
+    if (p >= HOST_MAX_QUEUES || q >= HOST_MAX_QUEUES) return -1;
+    host_port_queue[p] = (int)q;
+    return 0;
+}
+
+int sys_event_port_disconnect(sys_event_port_t p) {
+    if (p >= HOST_MAX_QUEUES) return -1;
+    host_port_queue[p] = -1;
+    return 0;
+}
+
+/* A full queue refuses the event (EBUSY on lv2) */
+int sys_event_port_send(sys_event_port_t p, uint64_t d1, uint64_t d2, uint64_t d3) {
+    if (p >= HOST_MAX_QUEUES || host_port_queue[p] < 0) return -1;
+    host_queue_t *hq = &host_queue[host_port_queue[p]];
+    pthread_mutex_lock(&hq->lock);
+    if (hq->closed || hq->head - hq->tail >= hq->depth) {
+        pthread_mutex_unlock(&hq->lock);
+        return -1;
+    }
+    sys_event_t *ev = &hq->ev[hq->head % HOST_QUEUE_DEPTH];
+    ev->source = p;
+    ev->data1 = d1;
+    ev->data2 = d2;
+    ev->data3 = d3;
+    hq->head++;
+    pthread_cond_signal(&hq->cond);
+    pthread_mutex_unlock(&hq->lock);
+    return 0;
+}
+
+/* --- Memory and time --- */
+
+int sys_memory_allocate(size_t size, uint64_t flags, sys_addr_t *addr) {
+    (void)flags;
+    void *p = NULL;
+    if (size == 0 || (size & 0xFFFF) || posix_memalign(&p, 0x10000, size) != 0)
+        return -1;
+    HOST_COUNT(allocs, 1);
+    HOST_COUNT(alloc_bytes, size);
+    *addr = (sys_addr_t)p;
+    return 0;
+}
+
+int sys_memory_free(sys_addr_t addr) {
+    free((void*)addr);
+    return 0;
+}
+
+system_time_t sys_time_get_system_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (system_time_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int sys_timer_usleep(uint64_t usec) {
+    if (host_no_sleep) return 0;
+    struct timespec ts = { (time_t)(usec / 1000000), (long)(usec % 1000000) * 1000 };
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {}
+    return 0;
+}
+
+/* --- Files --- */
+
+/* host_path: console path under host_root */
+static const char *host_path(char *out, size_t size, const char *path) {
+    if (!host_root[0]) return path;
+    snprintf(out, size, "%s%s", host_root, path);
+    return out;
+}
+
+s32 sysFsOpen(const char *path, s32 oflags, s32 *fd, const void *arg, u64 argsize) {
+    char buf[512];
+    (void)arg;
+    (void)argsize;
+    int fl = (oflags & 3) == SYS_O_WRONLY ? O_WRONLY :
+             (oflags & 3) == SYS_O_RDWR ? O_RDWR : O_RDONLY;
+    if (oflags & SYS_O_CREAT) fl |= O_CREAT;
+    if (oflags & SYS_O_TRUNC) fl |= O_TRUNC;
+    if (oflags & SYS_O_APPEND) fl |= O_APPEND;
+    int r = open(host_path(buf, sizeof(buf), path), fl, 0644);
+    if (r < 0) return -1;
+    HOST_COUNT(opens, 1);
+    *fd = r;
+    return 0;
+}
+
+s32 sysFsClose(s32 fd) {
+    return close(fd) == 0 ? 0 : -1;
+}
+
+s32 sysFsRead(s32 fd, void *ptr, u64 len, u64 *nread) {
+    ssize_t r = read(fd, ptr, (size_t)len);
+    if (r < 0) return -1;
+    *nread = (u64)r;
+    return 0;
+}
+
+s32 sysFsWrite(s32 fd, const void *ptr, u64 len, u64 *written) {
+    ssize_t r = write(fd, ptr, (size_t)len);
+    if (r < 0) return -1;
+    HOST_COUNT(writes, 1);
+    HOST_COUNT(write_bytes, r);
+    *written = (u64)r;
+    return 0;
+}
+
+s32 sysFsLseek(s32 fd, s64 offset, s32 whence, u64 *pos) {
+    off_t r = lseek(fd, (off_t)offset, whence);
+    if (r < 0) return -1;
+    if (pos) *pos = (u64)r;
+    return 0;
+}
+
+static void host_stat(const struct stat *s, sysFSStat *st) {
+    memset(st, 0, sizeof(*st));
+    st->st_mode = (s32)s->st_mode;
+    st->st_atime = (s64)s->st_atim.tv_sec;
+    st->st_mtime = (s64)s->st_mtim.tv_sec;
+    st->st_ctime = (s64)s->st_ctim.tv_sec;
+    st->st_size = (u64)s->st_size;
+    st->st_blksize = (u64)s->st_blksize;
+}
+
+s32 sysFsFstat(s32 fd, sysFSStat *st) {
+    struct stat s;
+    if (fstat(fd, &s) != 0) return -1;
+    host_stat(&s, st);
+    return 0;
+}
+
+s32 sysFsStat(const char *path, sysFSStat *st) {
+    char buf[512];
+    struct stat s;
+    if (stat(host_path(buf, sizeof(buf), path), &s) != 0) return -1;
+    host_stat(&s, st);
+    return 0;
+}
+
+s32 sysFsFsync(s32 fd) {
+    HOST_COUNT(fsyncs, 1);
+    return fsync(fd) == 0 ? 0 : -1;
+}
+
+s32 sysFsUnlink(const char *path) {
+    char buf[512];
+    return unlink(host_path(buf, sizeof(buf), path)) == 0 ? 0 : -1;
+}
+
+s32 sysFsRename(const char *from, const char *to) {
+    char a[512], b[512];
+    return rename(host_path(a, sizeof(a), from), host_path(b, sizeof(b), to)) == 0 ? 0 : -1;
+}
+
+static DIR *host_dirs[HOST_MAX_DIRS];
+
+s32 sysFsOpendir(const char *path, s32 *fd) {
+    char buf[512];
+    DIR *d = opendir(host_path(buf, sizeof(buf), path));
+    if (!d) return -1;
+    pthread_mutex_lock(&host_table_lock);
+    for (int i = 0; i < HOST_MAX_DIRS; i++) {
+        if (!host_dirs[i]) {
+            host_dirs[i] = d;
+            pthread_mutex_unlock(&host_table_lock);
+            *fd = i;
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&host_table_lock);
+    closedir(d);
+    return -1;
+}
+
+/* An exhausted directory reads as *nread == 0, like sysFsReaddir */
+s32 sysFsReaddir(s32 fd, sysFSDirent *entry, u64 *nread) {
+    if (fd < 0 || fd >= HOST_MAX_DIRS || !host_dirs[fd]) return -1;
+    struct dirent *d = readdir(host_dirs[fd]);
+    if (!d) {
+        *nread = 0;
+        return 0;
+    }
+    size_t len = strlen(d->d_name);
+    if (len > 255) len = 255;
+    memcpy(entry->d_name, d->d_name, len);
+    entry->d_name[len] = 0;
+    entry->d_namlen = (u8)len;
+    entry->d_type = (u8)d->d_type;
+    *nread = sizeof(*entry);
+    return 0;
+}
+
+s32 sysFsClosedir(s32 fd) {
+    if (fd < 0 || fd >= HOST_MAX_DIRS || !host_dirs[fd]) return -1;
+    closedir(host_dirs[fd]);
+    host_dirs[fd] = NULL;
+    return 0;
+}
@@ -0,0 +1,150 @@
+/*
+ * lv2_host.h
+ *
+ * Host stand-ins for the lv2 / PSL1GHT calls plugin.c makes, so the portal
+ * engine, dump cache, journal, library and pad bindings build and run on a
+ * PC. plugin.c includes this instead of the SDK headers when SKY_HOST is
+ * defined; the implementations (POSIX files, pthreads) are in lv2_host.c.
+ * The hook engine is left out of host builds: the caller drives
+ * usb_read_hook / usb_write_hook itself. See tools/skybench.c.
+ *
+ * Only what plugin.c uses is here, with the SDK's names and signatures.
+ */
+
+#ifndef LV2_HOST_H
+#define LV2_HOST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int8_t s8;
+typedef int16_t s16;
+typedef int32_t s32;
+typedef int64_t s64;
+
+/* Threads */
+typedef uint64_t sys_ppu_thread_t;
+int sys_ppu_thread_create(sys_ppu_thread_t *id, void (*entry)(uint64_t), uint64_t arg,
+                          int prio, size_t stacksize, uint64_t flags, const char *name);
+int sys_ppu_thread_join(sys_ppu_thread_t id, uint64_t *exit_status);
+void sys_ppu_thread_exit(uint64_t val);
+
+/* Mutexes and condition variables (timeouts in microseconds, 0 = none) */
+typedef uint32_t sys_mutex_t;
+typedef uint32_t sys_cond_t;
+typedef struct { int unused; } sys_mutex_attribute_t;
+typedef struct { int unused; } sys_cond_attribute_t;
+#define sys_mutex_attribute_initialize(x) ((x).unused = 0)
+#define sys_cond_attribute_initialize(x)  ((x).unused = 0)
+int sys_mutex_create(sys_mutex_t *m, sys_mutex_attribute_t *attr);
+int sys_mutex_destroy(sys_mutex_t m);
+int sys_mutex_lock(sys_mutex_t m, uint64_t timeout);
+int sys_mutex_unlock(sys_mutex_t m);
+int sys_cond_create(sys_cond_t *c, sys_mutex_t m, sys_cond_attribute_t *attr);
+int sys_cond_destroy(sys_cond_t c);
+int sys_cond_wait(sys_cond_t c, uint64_t timeout);
+int sys_cond_signal(sys_cond_t c);
+
+/* Event queues and local ports */
+typedef uint32_t sys_event_queue_t;
+typedef uint32_t sys_event_port_t;
+typedef struct { uint64_t source, data1, data2, data3; } sys_event_t;
+typedef struct { int unused; } sys_event_queue_attribute_t;
+#define sys_event_queue_attribute_initialize(x) ((x).unused = 0)
+#define SYS_EVENT_QUEUE_LOCAL         0
+#define SYS_EVENT_PORT_LOCAL          1
+#define SYS_EVENT_PORT_NO_NAME        0
+#define SYS_EVENT_QUEUE_DESTROY_FORCE 1
+int sys_event_queue_create(sys_event_queue_t *q, sys_event_queue_attribute_t *attr,
+                           uint64_t key, int size);
+int sys_event_queue_destroy(sys_event_queue_t q, int mode);
+int sys_event_queue_receive(sys_event_queue_t q, sys_event_t *ev, uint64_t timeout);
+int sys_event_port_create(sys_event_port_t *p, int type, uint64_t name);
+int sys_event_port_destroy(sys_event_port_t p);
+int sys_event_port_connect_local(sys_event_port_t p, sys_event_queue_t q);
+int sys_event_port_disconnect(sys_event_port_t p);
+int sys_event_port_send(sys_event_port_t p, uint64_t d1, uint64_t d2, uint64_t d3);
+
+/* Memory: a host pointer fits in sys_addr_t here */
+typedef uintptr_t sys_addr_t;
+#define SYS_MEMORY_PAGE_SIZE_64K 0x200
+int sys_memory_allocate(size_t size, uint64_t flags, sys_addr_t *addr);
+int sys_memory_free(sys_addr_t addr);
+
+/* Time */
+typedef int64_t system_time_t;
+system_time_t sys_time_get_system_time(void);
+int sys_timer_usleep(uint64_t usec);
+
+/* Pad (only the types: the pad hook is not installed on the host) */
+#define CELL_PAD_MAX_PORT_NUM        7
+#define CELL_PAD_MAX_CODES           64
+#define CELL_PAD_BTN_OFFSET_DIGITAL1 2
+#define CELL_PAD_BTN_OFFSET_DIGITAL2 3
+#define CELL_PAD_OK                  0
+typedef struct {
+    int32_t len;
+    uint16_t button[CELL_PAD_MAX_CODES];
+} CellPadData;
+
+/* Files: console paths are mapped below host_root */
+#define SYS_O_RDONLY 000000
+#define SYS_O_WRONLY 000001
+#define SYS_O_RDWR   000002
+#define SYS_O_CREAT  000100
+#define SYS_O_TRUNC  001000
+#define SYS_O_APPEND 002000
+#define SYS_SEEK_SET 0
+#define SYS_SEEK_CUR 1
+#define SYS_SEEK_END 2
+
+typedef struct {
+    s32 st_mode;
+    s32 st_uid;
+    s32 st_gid;
+    s64 st_atime;
+    s64 st_mtime;
+    s64 st_ctime;
+    u64 st_size;
+    u64 st_blksize;
+} sysFSStat;
+
+typedef struct {
+    u8 d_type;
+    u8 d_namlen;
+    char d_name[256];
+} sysFSDirent;
+
+s32 sysFsOpen(const char *path, s32 oflags, s32 *fd, const void *arg, u64 argsize);
+s32 sysFsClose(s32 fd);
+s32 sysFsRead(s32 fd, void *ptr, u64 len, u64 *nread);
+s32 sysFsWrite(s32 fd, const void *ptr, u64 len, u64 *written);
+s32 sysFsLseek(s32 fd, s64 offset, s32 whence, u64 *pos);
+s32 sysFsFstat(s32 fd, sysFSStat *st);
+s32 sysFsStat(const char *path, sysFSStat *st);
+s32 sysFsFsync(s32 fd);
+s32 sysFsUnlink(const char *path);
+s32 sysFsRename(const char *from, const char *to);
+s32 sysFsOpendir(const char *path, s32 *fd);
+s32 sysFsReaddir(s32 fd, sysFSDirent *entry, u64 *nread);
+s32 sysFsClosedir(s32 fd);
+
+/* Harness side */
+typedef struct {
+    uint64_t allocs;      /* sys_memory_allocate calls ... */
+    uint64_t alloc_bytes; /* ... and their total size */
+    uint64_t opens;
+    uint64_t writes;
+    uint64_t write_bytes;
+    uint64_t fsyncs;
+} host_stats_t;
+
+extern char host_root[256];      /* prefix for every console path, "" = none */
+extern int host_no_sleep;        /* sys_timer_usleep returns at once */
+extern host_stats_t host_stats;   /* updated atomically */
+
+#endif
@@ -0,0 +1,473 @@
+/*
+ * skybench.c
+ *
+ * Host tool: replay a portal USB trace through usb_write_hook /
+ * usb_read_hook of a PC build of plugin.c (see tools/host/lv2_host.h) and
+ * report per-call latency, memory reserved and bytes written to disk, so
+ * hot-path regressions show up before a build goes to a console.
+ *
+ * Build: cc -O2 -DSKY_HOST -DLAZY_START=0 -o skybench tools/skybench.c \
+ *            tools/host/lv2_host.c plugin.c -lpthread
+ * Usage: skybench gen <out.trace> [polls]
+ *        skybench run [-l loops] [-t title id] [-p] <root dir> <trace>
+ *
+ * "gen" writes a synthetic session (reset, activate, status polls, a few
+ * block writes, a read of every block of figure 0) with the replies it
+ * gets on a fresh scratch root, i.e. from the default figure, after
+ * checking the fixed-format ones against the portal protocol. Replaying
+ * it on an empty root dir checks every reply; dumps of your own in root
+ * dir make the block reads differ. "run" treats root dir
+ * as the console's filesystem (dumps, pack and pad config as on
+ * /dev_hdd0/tmp), plays the trace loops times and stops the plugin, which
+ * flushes and writes its own statistics to STATS_PATH under root dir. -p
+ * keeps the recorded gaps and the title's portal timing; without it both
+ * are skipped and only the hooks' own cost is measured.
+ *
+ * Trace format (all fields big-endian; keep in sync with plugin.c):
+ *   header  magic[4] version[2] flags[2] vid[2] pid[2] reserved[4]
+ *   record  delta_us[4] kind[1] len[1] rc[2] data[n]
+ *
+ * delta_us is the time since the previous record. kind 'W' is a
+ * usb_write_hook call, data the command (n = len). kind 'R' is a
+ * usb_read_hook call for len bytes that returned rc; with TRACE_REPLIES in
+ * flags, data is what it returned (n = rc if rc > 0), otherwise n = 0.
+ */
+
+#define _GNU_SOURCE
+#include "host/lv2_host.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <sys/stat.h>
+
+#define TRACE_MAGIC       0x534B5431 /* 'SKT1' */
+#define TRACE_VERSION     1
+#define TRACE_HEADER_SIZE 16
+#define TRACE_REC_SIZE    8
+#define TRACE_REPLIES     1          /* read records carry the data */
+#define TRACE_DATA_MAX    255
+
+#define BENCH_HANDLE      1          /* dev_handle the portal is replayed on */
+#define BENCH_TITLE       "BLUS31442"
+#define BENCH_VID         0x1234     /* PORTAL_VENDOR_ID */
+#define BENCH_PID         0x5678     /* PORTAL_PRODUCT_ID */
+
+/* plugin.c */
+int start_plugin(void);
+int stop_plugin(void);
+int usb_read_hook(int dev_handle, void *buf, int len, int timeout);
+int usb_write_hook(int dev_handle, const void *buf, int len, int timeout);
+void usb_device_attached(int dev_handle, uint16_t vid, uint16_t pid);
+
+typedef struct {
+    uint32_t delta_us;
+    uint8_t kind;
+    uint8_t len;
+    int16_t rc;
+    uint8_t data[TRACE_DATA_MAX];
+} trace_rec_t;
+
+static int root_prepare(const char *root, const char *title);
+
+typedef struct {
+    uint64_t *ns;
+    size_t n, cap;
+} lat_t;
+
+static uint32_t get_be32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint16_t get_be16(const uint8_t *p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static void put_be32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static void put_be16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* --- Trace file --- */
+
+static int trace_put(FILE *f, const trace_rec_t *r, uint16_t flags) {
+    uint8_t h[TRACE_REC_SIZE];
+    size_t dn = r->kind == 'W' ? r->len :
+                ((flags & TRACE_REPLIES) && r->rc > 0) ? (size_t)r->rc : 0;
+    put_be32(h, r->delta_us);
+    h[4] = r->kind;
+    h[5] = r->len;
+    put_be16(h + 6, (uint16_t)r->rc);
+    if (fwrite(h, 1, sizeof(h), f) != sizeof(h)) return -1;
+    return fwrite(r->data, 1, dn, f) == dn ? 0 : -1;
+}
+
+static trace_rec_t *session_add(trace_rec_t *r, uint32_t delta_us, uint8_t kind,
+                                const uint8_t *req) {
+    memset(r, 0, sizeof(*r));
+    r->delta_us = delta_us;
+    r->kind = kind;
+    r->len = 32;
+    r->rc = kind == 'W' ? 32 : 0;
+    if (req) memcpy(r->data, req, 32);
+    return r + 1;
+}
+
+/* session_build: the synthetic session, into recs (session_size records) */
+#define session_size(polls) (2 * 2 + 4 * 2 + 64 * 2 + 2 * (size_t)(polls))
+static size_t session_build(trace_rec_t *recs, int polls) {
+    trace_rec_t *r = recs;
+    uint8_t req[32] = {0};
+    req[0] = 'R';
+    r = session_add(r, 0, 'W', req);
+    r = session_add(r, 1000, 'R', NULL);
+    req[0] = 'A';
+    req[1] = 1;
+    r = session_add(r, 1000, 'W', req);
+    r = session_add(r, 1000, 'R', NULL);
+    for (int i = 0; i < polls; i++) r = session_add(r, 10000, 'R', NULL);
+    /* writes before the reads, so every loop of a replay reads the same */
+    for (int b = 8; b < 12; b++) {
+        memset(req, 0, sizeof(req));
+        req[0] = 'W';
+        req[1] = 0x10;
+        req[2] = (uint8_t)b;
+        memset(req + 3, 0x40 + b, 16);
+        r = session_add(r, 2000, 'W', req);
+        r = session_add(r, 2000, 'R', NULL);
+    }
+    for (int b = 0; b < 64; b++) {
+        memset(req, 0, sizeof(req));
+        req[0] = 'Q';
+        req[1] = 0x10;
+        req[2] = (uint8_t)b;
+        r = session_add(r, 2000, 'W', req);
+        r = session_add(r, 2000, 'R', NULL);
+    }
+    for (int i = 0; i < polls; i++) r = session_add(r, 10000, 'R', NULL);
+    return (size_t)(r - recs);
+}
+
+/* session_check: the first bytes of each command's reply, as the portal
+ * protocol fixes them (see "Portal command engine" in plugin.c). Returns
+ * the index of the first reply that breaks it, or count. */
+static size_t session_check(const trace_rec_t *recs, size_t count) {
+    for (size_t i = 0; i + 1 < count; i++) {
+        const uint8_t *q = recs[i].data, *a = recs[i + 1].data;
+        uint8_t want[4];
+        size_t n = 0;
+        if (recs[i].kind != 'W' || recs[i + 1].kind != 'R') continue;
+        switch (q[0]) {
+        case 'R': want[0] = 'R'; want[1] = 0x02; want[2] = 0x1b; n = 3; break;
+        case 'A': want[0] = 'A'; want[1] = q[1]; want[2] = 0xff; want[3] = 0x77; n = 4; break;
+        case 'Q': /* then the block's data */
+        case 'W': want[0] = q[0]; want[1] = 0x10 | (q[1] & 0x0F); want[2] = q[2]; n = 3; break;
+        }
+        /* 'Q' / 'W' 01 instead of 1n: no such figure or block */
+        if (q[0] != 'R' && n == 3 && a[1] == 0x01) want[1] = 0x01;
+        if (recs[i + 1].rc < (int)n || memcmp(a, want, n) != 0) return i + 1;
+    }
+    return count;
+}
+
+static int rm_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)st;
+    (void)type;
+    (void)ftw;
+    return remove(path);
+}
+
+/* gen: the synthetic session and the replies the plugin gives on a fresh
+ * root, as if captured from a portal */
+static int trace_gen(const char *path, int polls) {
+    char root[] = "/tmp/skybench.XXXXXX";
+    size_t count;
+    trace_rec_t *recs = malloc(session_size(polls < 0 ? 0 : polls) * sizeof(*recs));
+    if (!recs || polls < 0) return 1;
+    count = session_build(recs, polls);
+
+    if (!mkdtemp(root) || root_prepare(root, BENCH_TITLE) != 0) {
+        fprintf(stderr, "%s: cannot set up a scratch root\n", root);
+        free(recs);
+        return 1;
+    }
+    snprintf(host_root, sizeof(host_root), "%s", root);
+    host_no_sleep = 1;
+    int ok = start_plugin() == 0;
+    if (ok) {
+        usb_device_attached(BENCH_HANDLE, BENCH_VID, BENCH_PID);
+        for (size_t i = 0; i < count; i++) {
+            trace_rec_t *r = &recs[i];
+            if (r->kind == 'W') usb_write_hook(BENCH_HANDLE, r->data, r->len, 0);
+            else r->rc = (int16_t)usb_read_hook(BENCH_HANDLE, r->data, r->len, 0);
+        }
+        stop_plugin();
+    }
+    nftw(root, rm_entry, 16, FTW_DEPTH | FTW_PHYS);
+    host_root[0] = 0;
+    if (!ok) {
+        fprintf(stderr, "start_plugin failed (title %s)\n", BENCH_TITLE);
+        free(recs);
+        return 1;
+    }
+    size_t bad = session_check(recs, count);
+    if (bad != count) {
+        fprintf(stderr, "record %zu: reply to '%c' is not what a portal sends\n", bad,
+                recs[bad - 1].data[0]);
+        free(recs);
+        return 1;
+    }
+
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        perror(path);
+        free(recs);
+        return 1;
+    }
+    uint8_t hdr[TRACE_HEADER_SIZE] = {0};
+    put_be32(hdr, TRACE_MAGIC);
+    put_be16(hdr + 4, TRACE_VERSION);
+    put_be16(hdr + 6, TRACE_REPLIES);
+    put_be16(hdr + 8, BENCH_VID);
+    put_be16(hdr + 10, BENCH_PID);
+    ok = fwrite(hdr, 1, sizeof(hdr), f) == sizeof(hdr);
+    for (size_t i = 0; i < count && ok; i++) ok = trace_put(f, &recs[i], TRACE_REPLIES) == 0;
+    if (fclose(f) != 0) ok = 0;
+    free(recs);
+    if (!ok) {
+        fprintf(stderr, "%s: write failed\n", path);
+        remove(path);
+        return 1;
+    }
+    return 0;
+}
+
+/* trace_load: whole trace into an array of records */
+static trace_rec_t *trace_load(const char *path, size_t *count, uint16_t *flags,
+                               uint16_t *vid, uint16_t *pid) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return NULL;
+    }
+    uint8_t hdr[TRACE_HEADER_SIZE];
+    if (fread(hdr, 1, sizeof(hdr), f) != sizeof(hdr) || get_be32(hdr) != TRACE_MAGIC ||
+        get_be16(hdr + 4) != TRACE_VERSION) {
+        fprintf(stderr, "%s: not a version %d trace\n", path, TRACE_VERSION);
+        fclose(f);
+        return NULL;
+    }
+    *flags = get_be16(hdr + 6);
+    *vid = get_be16(hdr + 8);
+    *pid = get_be16(hdr + 10);
+
+    trace_rec_t *recs = NULL;
+    size_t n = 0, cap = 0;
+    uint8_t h[TRACE_REC_SIZE];
+    while (fread(h, 1, sizeof(h), f) == sizeof(h)) {
+        if (n == cap) {
+            cap = cap ? cap * 2 : 1024;
+            trace_rec_t *grown = realloc(recs, cap * sizeof(*recs));
+            if (!grown) break;
+            recs = grown;
+        }
+        trace_rec_t *r = &recs[n];
+        r->delta_us = get_be32(h);
+        r->kind = h[4];
+        r->len = h[5];
+        r->rc = (int16_t)get_be16(h + 6);
+        size_t dn = r->kind == 'W' ? r->len :
+                    ((*flags & TRACE_REPLIES) && r->rc > 0) ? (size_t)r->rc : 0;
+        if ((r->kind != 'W' && r->kind != 'R') || dn > r->len ||
+            fread(r->data, 1, dn, f) != dn) {
+            fprintf(stderr, "%s: bad record %zu\n", path, n);
+            break;
+        }
+        n++;
+    }
+    fclose(f);
+    *count = n;
+    return recs;
+}
+
+/* --- Replay --- */
+
+static void lat_add(lat_t *l, uint64_t ns) {
+    if (l->n == l->cap) {
+        l->cap = l->cap ? l->cap * 2 : 4096;
+        uint64_t *grown = realloc(l->ns, l->cap * sizeof(uint64_t));
+        if (!grown) return;
+        l->ns = grown;
+    }
+    l->ns[l->n++] = ns;
+}
+
+static int u64_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static void lat_report(const char *name, lat_t *l) {
+    if (l->n == 0) {
+        printf("%-10s no calls\n", name);
+        return;
+    }
+    qsort(l->ns, l->n, sizeof(uint64_t), u64_cmp);
+    uint64_t sum = 0;
+    for (size_t i = 0; i < l->n; i++) sum += l->ns[i];
+    printf("%-10s %8zu calls  mean %6llu  p50 %6llu  p99 %6llu  max %8llu ns\n", name, l->n,
+           (unsigned long long)(sum / l->n), (unsigned long long)l->ns[l->n / 2],
+           (unsigned long long)l->ns[l->n * 99 / 100], (unsigned long long)l->ns[l->n - 1]);
+}
+
+/* root_prepare: the console directories plugin.c uses, and a PARAM.SFO
+ * that makes start_plugin pick title */
+static int root_prepare(const char *root, const char *title) {
+    char path[512];
+    static const char *dirs[] = { "/dev_bdvd", "/dev_bdvd/PS3_GAME", "/dev_hdd0",
+                                  "/dev_hdd0/tmp" };
+    mkdir(root, 0755);
+    for (size_t i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++) {
+        snprintf(path, sizeof(path), "%s%s", root, dirs[i]);
+        mkdir(path, 0755);
+    }
+
+    /* header, one TITLE_ID entry, key table, data table (little-endian) */
+    uint8_t sfo[64] = { 0x00, 'P', 'S', 'F', 0x01, 0x01, 0, 0, 36, 0, 0, 0, 48, 0, 0, 0,
+                        1, 0, 0, 0,
+                        0, 0, 0x04, 0x02, 0, 0, 0, 0, 16, 0, 0, 0, 0, 0, 0, 0 };
+    size_t tl = strlen(title) + 1;
+    if (tl > 16) return -1;
+    sfo[24] = (uint8_t)tl;
+    memcpy(sfo + 36, "TITLE_ID", 9);
+    memcpy(sfo + 48, title, tl);
+    snprintf(path, sizeof(path), "%s/dev_bdvd/PS3_GAME/PARAM.SFO", root);
+    FILE *f = fopen(path, "wb");
+    if (!f) return -1;
+    int ok = fwrite(sfo, 1, sizeof(sfo), f) == sizeof(sfo);
+    return (fclose(f) == 0 && ok) ? 0 : -1;
+}
+
+static int bench_run(const char *root, const char *trace, const char *title, int loops,
+                     int paced) {
+    size_t count = 0;
+    uint16_t flags = 0, vid = 0, pid = 0;
+    trace_rec_t *recs = trace_load(trace, &count, &flags, &vid, &pid);
+    if (!recs) return 1;
+    if (root_prepare(root, title) != 0) {
+        fprintf(stderr, "%s: cannot set up\n", root);
+        return 1;
+    }
+    snprintf(host_root, sizeof(host_root), "%s", root);
+    host_no_sleep = !paced;
+
+    host_stats_t s0 = host_stats;
+    if (start_plugin() != 0) {
+        fprintf(stderr, "start_plugin failed (title %s)\n", title);
+        return 1;
+    }
+    host_stats_t s1 = host_stats;
+    if (s1.allocs == s0.allocs) {
+        /* no arena: the title has no profile and nothing was hooked */
+        fprintf(stderr, "title %s has no profile, the plugin stays dormant\n", title);
+        return 1;
+    }
+    usb_device_attached(BENCH_HANDLE, vid, pid);
+
+    lat_t rd = {0}, wr = {0};
+    size_t mismatches = 0, compared = 0;
+    uint8_t buf[TRACE_DATA_MAX];
+    for (int l = 0; l < loops; l++) {
+        for (size_t i = 0; i < count; i++) {
+            const trace_rec_t *r = &recs[i];
+            if (paced && r->delta_us) usleep(r->delta_us);
+            uint64_t t0 = now_ns();
+            if (r->kind == 'W') {
+                usb_write_hook(BENCH_HANDLE, r->data, r->len, 0);
+                lat_add(&wr, now_ns() - t0);
+                continue;
+            }
+            int rc = usb_read_hook(BENCH_HANDLE, buf, r->len, 0);
+            lat_add(&rd, now_ns() - t0);
+            if (!(flags & TRACE_REPLIES)) continue;
+            /* byte 5 of a status report is the portal's running counter;
+             * after the first loop a figure is no longer newly added, so
+             * only whether it is there counts (ADDED 11 = PRESENT 01) */
+            compared++;
+            int diff = rc != r->rc;
+            for (int k = 0; !diff && k < rc; k++) {
+                uint8_t mask = (buf[0] == 'S' && k >= 1 && k <= 4 && l > 0) ? 0x55 : 0xFF;
+                diff = ((buf[k] ^ r->data[k]) & mask) && !(buf[0] == 'S' && k == 5);
+            }
+            mismatches += diff;
+        }
+    }
+    host_stats_t s2 = host_stats;
+    stop_plugin();
+    host_stats_t s3 = host_stats;
+
+    printf("trace %s: %zu records x %d\n", trace, count, loops);
+    lat_report("usb_read", &rd);
+    lat_report("usb_write", &wr);
+    if (flags & TRACE_REPLIES)
+        printf("replies    %zu of %zu differ from the trace\n", mismatches, compared);
+    printf("memory     %llu allocations (%llu bytes) at start, %llu while replaying\n",
+           (unsigned long long)(s1.allocs - s0.allocs),
+           (unsigned long long)(s1.alloc_bytes - s0.alloc_bytes),
+           (unsigned long long)(s2.allocs - s1.allocs));
+    printf("disk       %llu bytes in %llu writes, %llu fsyncs while replaying;"
+           " %llu bytes at stop\n",
+           (unsigned long long)(s2.write_bytes - s1.write_bytes),
+           (unsigned long long)(s2.writes - s1.writes),
+           (unsigned long long)(s2.fsyncs - s1.fsyncs),
+           (unsigned long long)(s3.write_bytes - s2.write_bytes));
+    free(rd.ns);
+    free(wr.ns);
+    free(recs);
+    return 0;
+}
+
+static int usage(const char *argv0) {
+    fprintf(stderr, "usage: %s gen <out.trace> [polls]\n"
+                    "       %s run [-l loops] [-t title id] [-p] <root dir> <trace>\n",
+            argv0, argv0);
+    return 2;
+}
+
+int main(int argc, char **argv) {
+    if (argc >= 3 && strcmp(argv[1], "gen") == 0)
+        return trace_gen(argv[2], argc > 3 ? atoi(argv[3]) : 500);
+    if (argc < 2 || strcmp(argv[1], "run") != 0) return usage(argv[0]);
+
+    const char *title = BENCH_TITLE;
+    int loops = 1, paced = 0, i = 2;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-p") == 0) {
+            paced = 1;
+        } else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+            loops = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            title = argv[++i];
+        } else {
+            return usage(argv[0]);
+        }
+    }
+    if (argc - i != 2 || loops <= 0) return usage(argv[0]);
+    return bench_run(argv[i], argv[i + 1], title, loops, paced);
+}
@@ -0,0 +1,178 @@
+/*
+ * skypack.c
+ *
+ * Host tool: pack a directory of figure dumps (*.bin) into the library
+ * file the plugin reads from FIGURE_DIR PACK_SUFFIX. Copy the result next
+ * to FIGURE_DIR on the console (e.g. /dev_hdd0/tmp/skylanders.pak).
+ *
+ * Build: cc -O2 -o skypack tools/skypack.c
+ * Usage: skypack <dump dir> <out.pak>
+ *
+ * Format (all fields big-endian; keep in sync with plugin.c):
+ *   header  magic[4] version[2] count[2] index_crc[4] reserved[4]
+ *   index   count * { figure_id[4] variant[2] flags[2] offset[4] size[4]
+ *                     crc[4] reserved[12] name[64] }, sorted by name
+ *   records each at a PACK_ALIGN offset, zero padded
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <dirent.h>
+
+#define PACK_MAGIC       0x534B5031 /* 'SKP1' */
+#define PACK_VERSION     1
+#define PACK_HEADER_SIZE 16
+#define PACK_ENTRY_SIZE  96
+#define PACK_ALIGN       512
+#define PACK_MAX         512        /* FIGURE_LIB_MAX */
+#define NAME_MAX_LEN     64         /* FIGURE_NAME_MAX, incl. the NUL */
+#define DUMP_MAX         8192       /* MAX_DUMP_SIZE */
+
+typedef struct {
+    char name[NAME_MAX_LEN];
+    uint8_t data[DUMP_MAX];
+    size_t size;
+} dump_t;
+
+static uint32_t crc32_table[256];
+
+static void crc32_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+        crc32_table[i] = c;
+    }
+}
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t *p, size_t len) {
+    crc = ~crc;
+    while (len--)
+        crc = crc32_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static void put_be32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static void put_be16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+
+static int dump_cmp(const void *a, const void *b) {
+    return strcmp(((const dump_t*)a)->name, ((const dump_t*)b)->name);
+}
+
+/* read_dump: whole file into d; -1 if it is missing, empty or too big */
+static int read_dump(const char *dir, dump_t *d) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", dir, d->name);
+    FILE *f = fopen(path, "rb");
+    if (!f) return -1;
+    d->size = fread(d->data, 1, DUMP_MAX, f);
+    int more = fgetc(f) != EOF;
+    int err = ferror(f);
+    fclose(f);
+    return (d->size == 0 || more || err) ? -1 : 0;
+}
+
+static size_t align_up(size_t v) {
+    return (v + PACK_ALIGN - 1) & ~(size_t)(PACK_ALIGN - 1);
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <dump dir> <out.pak>\n", argv[0]);
+        return 2;
+    }
+    crc32_init();
+
+    dump_t *dumps = calloc(PACK_MAX, sizeof(dump_t));
+    if (!dumps) return 1;
+    int n = 0;
+
+    DIR *d = opendir(argv[1]);
+    if (!d) {
+        perror(argv[1]);
+        return 1;
+    }
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        size_t len = strlen(de->d_name);
+        if (len < 5 || strcmp(de->d_name + len - 4, ".bin") != 0) continue;
+        if (len >= NAME_MAX_LEN) {
+            fprintf(stderr, "skipping %s: name too long\n", de->d_name);
+            continue;
+        }
+        if (n == PACK_MAX) {
+            fprintf(stderr, "more than %d dumps, rest skipped\n", PACK_MAX);
+            break;
+        }
+        memcpy(dumps[n].name, de->d_name, len + 1);
+        if (read_dump(argv[1], &dumps[n]) != 0) {
+            fprintf(stderr, "skipping %s: unreadable or over %d bytes\n",
+                    de->d_name, DUMP_MAX);
+            continue;
+        }
+        n++;
+    }
+    closedir(d);
+    qsort(dumps, n, sizeof(dump_t), dump_cmp);
+
+    size_t index_len = (size_t)n * PACK_ENTRY_SIZE;
+    uint8_t *index = calloc(1, index_len ? index_len : 1);
+    if (!index) return 1;
+    size_t off = align_up(PACK_HEADER_SIZE + index_len);
+    for (int i = 0; i < n; i++) {
+        uint8_t *e = index + (size_t)i * PACK_ENTRY_SIZE;
+        const uint8_t *b = dumps[i].data;
+        /* toy type and variant from block 1 of the tag, little-endian */
+        uint32_t id = dumps[i].size >= 0x20 ? (uint32_t)(b[0x10] | (b[0x11] << 8)) : 0;
+        uint16_t var = dumps[i].size >= 0x20 ? (uint16_t)(b[0x1C] | (b[0x1D] << 8)) : 0;
+        put_be32(e, id);
+        put_be16(e + 4, var);
+        put_be32(e + 8, (uint32_t)off);
+        put_be32(e + 12, (uint32_t)dumps[i].size);
+        put_be32(e + 16, crc32_update(0, b, dumps[i].size));
+        memcpy(e + 32, dumps[i].name, strlen(dumps[i].name));
+        off = align_up(off + dumps[i].size);
+    }
+
+    uint8_t hdr[PACK_HEADER_SIZE] = {0};
+    put_be32(hdr, PACK_MAGIC);
+    put_be16(hdr + 4, PACK_VERSION);
+    put_be16(hdr + 6, (uint16_t)n);
+    put_be32(hdr + 8, crc32_update(0, index, index_len));
+
+    FILE *out = fopen(argv[2], "wb");
+    if (!out) {
+        perror(argv[2]);
+        return 1;
+    }
+    static const uint8_t pad[PACK_ALIGN];
+    size_t pos = PACK_HEADER_SIZE + index_len;
+    int ok = fwrite(hdr, 1, sizeof(hdr), out) == sizeof(hdr) &&
+             fwrite(index, 1, index_len, out) == index_len;
+    for (int i = 0; i < n && ok; i++) {
+        ok = fwrite(pad, 1, align_up(pos) - pos, out) == align_up(pos) - pos &&
+             fwrite(dumps[i].data, 1, dumps[i].size, out) == dumps[i].size;
+        pos = align_up(pos) + dumps[i].size;
+    }
+    if (fclose(out) != 0) ok = 0;
+    if (!ok) {
+        fprintf(stderr, "%s: write failed\n", argv[2]);
+        remove(argv[2]);
+        return 1;
+    }
+    printf("%d dumps packed into %s\n", n, argv[2]);
+    free(index);
+    free(dumps);
+    return 0;
+}